@@ -0,0 +1,63 @@
+#!/bin/sh
+# Multi-stage throughput benchmark for the pin builtin (see "help pin").
+# Runs the same pipeline RUNS times with "pin off" and with "pin auto" and
+# prints the total and average wall time of each mode, plus the placement
+# that "pin report" saw for the last run.
+#
+# Usage: sh helps/pin_bench.sh [RUNS] [SIZE]
+#   RUNS  times the pipeline runs per mode (default 10)
+#   SIZE  numbers fed through the pipeline (default 3000000)
+#
+# The shell only runs on a terminal, so script(1) gives it a pseudo terminal.
+
+RUNS=${1:-10}
+SIZE=${2:-3000000}
+PIPELINE="seq 1 $SIZE | sort -n | uniq | wc -l"
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+cc -o "$WORK/nautilus" "$ROOT/main.c" || exit 1
+
+echo "pipeline: $PIPELINE"
+echo "runs per mode: $RUNS"
+
+for mode in off auto; do
+    input="$WORK/input_$mode"
+    echo "pin $mode" > "$input"
+    i=0
+    while [ "$i" -lt "$RUNS" ]; do
+        echo "$PIPELINE" >> "$input"
+        i=$((i + 1))
+    done
+    echo "pin report" >> "$input"
+    echo "touch done" >> "$input"
+    echo "exit" >> "$input"
+
+    # script(1) hangs up the shell soon after its input ends, so keep the input
+    # open until the shell has run everything (or died). The shell writes its
+    # history, buffer files and "done" in the working directory
+    rm -f "$WORK/done" "$WORK/exited"
+    start=$(date +%s%N)
+    (cat "$input"; while [ ! -f "$WORK/done" ] && [ ! -f "$WORK/exited" ]; do sleep 0.1; done) |
+        (cd "$WORK" && script -qc "$WORK/nautilus" /dev/null > "$WORK/output_$mode"; touch "$WORK/exited")
+    end=$(date +%s%N)
+
+    if [ ! -f "$WORK/done" ]; then
+        echo "pin $mode: the shell stopped before running every pipeline" >&2
+        exit 1
+    fi
+
+    # Every run has to print SIZE, the number of distinct lines
+    ok=$(tr -d '\r' < "$WORK/output_$mode" | grep -c "\$ $SIZE\$")
+    if [ "$ok" -ne "$RUNS" ]; then
+        echo "pin $mode: only $ok of $RUNS runs printed $SIZE" >&2
+        exit 1
+    fi
+
+    total=$(((end - start) / 1000000))
+    echo
+    echo "pin $mode: $total ms total, $((total / RUNS)) ms per run"
+    tr -d '\r' < "$WORK/output_$mode" | sed -n '/stage  *pid/,$p' | sed 's/^nautilus \$ //; /^nautilus \$/d'
+done
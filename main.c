@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,12 +8,15 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <sched.h>
+#include <errno.h>
 #include "include/util.h"
 
 #define MAXLINE 1024
 #define LIMIT 256
 #define PIPE_FILE "pipe_file"
 #define MAX_HISTORY_SIZE 10
+#define NODE_DIR "/sys/devices/system/node"
 
 char history[MAX_HISTORY_SIZE][MAXLINE];
 int history_count = 0;
@@ -102,6 +106,8 @@ int ntl_history(char **args);
 
 int ntl_again(char **args);
 
+int ntl_pin(char **args);
+
 int ntl_execute(char **args);
 
 char *builtin_str[] = {
@@ -179,6 +185,9 @@ int ntl_help(char **args) {
     else if(strcmp(args[1], "spaces") == 0){
         read_file("helps/spaces");
     }
+    else if(strcmp(args[1], "pin") == 0){
+        read_file("helps/pin");
+    }
     else{
         printf("Bug found");
     }
@@ -351,18 +360,328 @@ void RedirectAppendOutput(char *outputFile, int fileDescriptor) {
 
 /* ==========================================================================   */
 
+// Placement modes for the stages of a pipeline (see "help pin")
+#define PIN_OFF 0
+#define PIN_SET 1
+#define PIN_AUTO 2
+
+int pin_mode = PIN_OFF;
+cpu_set_t pin_set;              // cpus every stage is allowed to run on
+int pin_node = -1;              // PIN_AUTO: node pin_set was taken from
+
+int cpu_node[CPU_SETSIZE];      // NUMA node of each cpu, -1 if unknown
+int topology_loaded = 0;
+int topology_readable = 0;      // NODE_DIR could be read
+
+// Where each stage of the last command line was placed and where it ran
+struct stage_info {
+    pid_t pid;
+    char name[32];
+    cpu_set_t allowed;
+    int cpu;
+};
+
+struct stage_info stages[LIMIT];
+int numStages = 0;
+
+// Parses a kernel cpu list like "0-3,8,10-11". Returns the number of cpus or -1
+int parse_cpulist(const char *list, cpu_set_t *set) {
+    const char *p = list;
+    char *end;
+
+    CPU_ZERO(set);
+    while (*p != '\0' && *p != '\n') {
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) return -1;
+        p = end;
+
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) return -1;
+            p = end;
+        }
+        if (last >= CPU_SETSIZE) return -1;
+
+        for (long c = first; c <= last; c++) CPU_SET(c, set);
+
+        if (*p == ',') {
+            p++;
+            if (*p == '\0' || *p == '\n') return -1;
+        } else if (*p != '\0' && *p != '\n') {
+            return -1;
+        }
+    }
+    return CPU_COUNT(set);
+}
+
+int read_cpulist(const char *path, cpu_set_t *set) {
+    char line[BUFSIZ];
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return -1;
+
+    if (fgets(line, sizeof(line), file) == NULL) {
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    return parse_cpulist(line, set);
+}
+
+void format_cpulist(cpu_set_t *set, char *buf, int size) {
+    int pos = 0;
+
+    buf[0] = '\0';
+    for (int c = 0; c < CPU_SETSIZE && pos < size; c++) {
+        if (!CPU_ISSET(c, set)) continue;
+
+        int last = c;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) last++;
+
+        if (last == c) {
+            pos += snprintf(buf + pos, size - pos, "%s%d", pos ? "," : "", c);
+        } else {
+            pos += snprintf(buf + pos, size - pos, "%s%d-%d", pos ? "," : "", c, last);
+        }
+        c = last;
+    }
+}
+
+// Returns 1 if the NUMA topology could be read, 0 otherwise
+int load_topology() {
+    char path[128];
+    cpu_set_t nodes, cpus;
+
+    if (topology_loaded) return topology_readable;
+    topology_loaded = 1;
+
+    for (int c = 0; c < CPU_SETSIZE; c++) cpu_node[c] = -1;
+
+    // Without NUMA support in the kernel every cpu stays on the unknown node
+    if (read_cpulist(NODE_DIR "/has_cpu", &nodes) <= 0) return 0;
+    topology_readable = 1;
+
+    for (int node = 0; node < CPU_SETSIZE; node++) {
+        if (!CPU_ISSET(node, &nodes)) continue;
+
+        snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", node);
+        if (read_cpulist(path, &cpus) <= 0) continue;
+
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &cpus)) cpu_node[c] = node;
+        }
+    }
+    return 1;
+}
+
+// Restricts every stage to the cpus of the shell's node. Stages run one after another
+// through the buffer files, so they share the node's memory and last level cache while
+// the scheduler can still move each one to an idle cpu of the node. Returns the number
+// of cpus in the plan, or -1 after printing why no plan could be made
+int pin_auto_plan() {
+    cpu_set_t allowed, nodeCpus;
+    int cpu;
+    int node;
+
+    if (!load_topology()) {
+        fprintf(stderr, "ntl: pin: could not read the cpu topology from " NODE_DIR "\n");
+        return -1;
+    }
+    if ((cpu = sched_getcpu()) < 0 || sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("ntl: pin");
+        return -1;
+    }
+
+    if ((node = cpu_node[cpu]) == -1) {
+        fprintf(stderr, "ntl: pin: cpu %d is not on any NUMA node\n", cpu);
+        return -1;
+    }
+
+    CPU_ZERO(&nodeCpus);
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &allowed) && cpu_node[c] == node) {
+            CPU_SET(c, &nodeCpus);
+        }
+    }
+    if (CPU_COUNT(&nodeCpus) == 0) {
+        fprintf(stderr, "ntl: pin: none of the cpus of node %d can be used\n", node);
+        return -1;
+    }
+
+    pin_set = nodeCpus;
+    pin_node = node;
+    return CPU_COUNT(&nodeCpus);
+}
+
+void pin_stage_set(cpu_set_t *set) {
+    if (pin_mode != PIN_OFF) {
+        *set = pin_set;
+    } else if (sched_getaffinity(0, sizeof(*set), set) != 0) {
+        CPU_ZERO(set);
+    }
+}
+
+// Field 39 of /proc/<pid>/stat is the cpu the process last ran on
+int last_cpu(pid_t child) {
+    char path[64];
+    char buf[1024];
+    char *save;
+    char *p;
+    size_t n;
+    int field = 2;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", child);
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return -1;
+
+    n = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    buf[n] = '\0';
+
+    // The command name may contain spaces, so start counting after its closing parenthesis
+    if ((p = strrchr(buf, ')')) == NULL) return -1;
+
+    for (p = strtok_r(p + 1, " ", &save); p != NULL; p = strtok_r(NULL, " ", &save)) {
+        if (++field == 39) return atoi(p);
+    }
+    return -1;
+}
+
+void wait_stage(int stage, pid_t child) {
+    siginfo_t info;
+
+    // Look at the finished child before reaping it, /proc forgets it afterwards
+    while (waitid(P_PID, child, &info, WEXITED | WNOWAIT) == -1) {
+        if (errno != EINTR) break;
+    }
+    stages[stage].cpu = last_cpu(child);
+    waitpid(child, NULL, 0);
+}
+
+void pin_print_mode() {
+    char cpus[BUFSIZ];
+
+    if (pin_mode == PIN_OFF) {
+        printf("pin: off\n");
+    } else if (pin_mode == PIN_SET) {
+        format_cpulist(&pin_set, cpus, sizeof(cpus));
+        printf("pin: %s\n", cpus);
+    } else {
+        format_cpulist(&pin_set, cpus, sizeof(cpus));
+        printf("pin: auto (node %d: %s)\n", pin_node, cpus);
+    }
+}
+
+void pin_report() {
+    char cpus[BUFSIZ];
+
+    if (numStages == 0) {
+        printf("No command has been launched yet\n");
+        return;
+    }
+
+    load_topology();
+    printf("%-6s %-8s %-16s %-16s %-7s %s\n", "stage", "pid", "command", "allowed", "ran on", "node");
+    for (int i = 0; i < numStages; i++) {
+        int cpu = stages[i].cpu;
+        format_cpulist(&stages[i].allowed, cpus, sizeof(cpus));
+        printf("%-6d %-8d %-16s %-16s %-7d %d\n", i, stages[i].pid, stages[i].name, cpus,
+               cpu, cpu >= 0 && cpu < CPU_SETSIZE ? cpu_node[cpu] : -1);
+    }
+}
+
+int is_separator(char *arg) {
+    return strcmp(arg, "<") == 0 || strcmp(arg, ">") == 0 || strcmp(arg, "|") == 0 || strcmp(arg, ">>") == 0;
+}
+
+int ntl_pin(char **args) {
+    int savedMode = pin_mode;
+    cpu_set_t savedSet = pin_set;
+    int savedNode = pin_node;
+    cpu_set_t set, usable;
+    int status;
+
+    if (args[1] == NULL) {
+        pin_print_mode();
+        return 1;
+    }
+
+    // pin runs in the shell itself and not through ntl_launch, so its output cannot be redirected
+    if (is_separator(args[1]) || (strcmp(args[1], "report") == 0 && args[2] != NULL)) {
+        fprintf(stderr, "ntl: pin: the output of pin cannot be redirected or piped\n");
+        return 1;
+    }
+    if (args[2] != NULL && is_separator(args[2])) {
+        fprintf(stderr, "ntl: pin: expected a command after \"%s\"\n", args[1]);
+        return 1;
+    }
+
+    if (strcmp(args[1], "report") == 0) {
+        pin_report();
+        return 1;
+    } else if (strcmp(args[1], "off") == 0) {
+        pin_mode = PIN_OFF;
+    } else if (strcmp(args[1], "auto") == 0) {
+        if (pin_auto_plan() < 0) return 1;
+        pin_mode = PIN_AUTO;
+    } else if (parse_cpulist(args[1], &set) > 0) {
+        // Keep only the cpus the shell may use, so stages never get an impossible mask
+        if (sched_getaffinity(0, sizeof(usable), &usable) != 0) CPU_ZERO(&usable);
+        CPU_AND(&set, &set, &usable);
+        if (CPU_COUNT(&set) == 0) {
+            fprintf(stderr, "ntl: pin: none of the cpus in %s can be used\n", args[1]);
+            return 1;
+        }
+        pin_set = set;
+        pin_mode = PIN_SET;
+    } else {
+        fprintf(stderr, "ntl: pin: expected \"off\", \"auto\", \"report\" or a cpu list\n");
+        return 1;
+    }
+
+    if (args[2] == NULL) return 1;
+
+    // "pin <placement> command..." only applies the placement to that command line
+    status = ntl_execute(args + 2);
+    pin_mode = savedMode;
+    pin_set = savedSet;
+    pin_node = savedNode;
+    return status;
+}
+
+/* ==========================================================================   */
+
 int ntl_launch(char **args, char *inputFile, char *outputFile, int option) {
     int err = -1;
     int fileDescriptor;
     int status = 0;
     int wasBuiltin = 0;
+    int stage = numStages++;
+    sigset_t chld, prev;
+
+    stages[stage].pid = -1;
+    stages[stage].cpu = -1;
+    snprintf(stages[stage].name, sizeof(stages[stage].name), "%s", args[0]);
+    pin_stage_set(&stages[stage].allowed);
+
+    // Keep the SIGCHLD handler from reaping the stage before its placement is recorded
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &prev);
 
     if ((pid = fork()) == -1) {
+        sigprocmask(SIG_SETMASK, &prev, NULL);
         printf("Child process could not be created\n");
         return -1;
     }
 
     if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+
+        if (pin_mode != PIN_OFF && sched_setaffinity(0, sizeof(cpu_set_t), &stages[stage].allowed) != 0) {
+            perror("ntl: pin");
+        }
+
         if (isPiping == 1) {
             RedirectInput(PIPE_FILE, fileDescriptor);
             isPiping = 0;
@@ -397,7 +716,11 @@ int ntl_launch(char **args, char *inputFile, char *outputFile, int option) {
         }
     }
 
-    waitpid(pid, NULL, 0);
+    if (pid > 0) {
+        stages[stage].pid = pid;
+        wait_stage(stage, pid);
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+    }
 
     return status;
 }
@@ -411,6 +734,8 @@ int ntl_parsing(char **commands, char **separators, int numCommands, int numSepa
     int buffer = 0;
     char *buffer_files[] = {"buffer_file1", "buffer_file2"};
 
+    numStages = 0;
+
     if(strcmp(commands[0], "exit") == 0) return 0;
 
     for (int i = 0; i < numCommands; i++) {
@@ -528,6 +853,8 @@ int ntl_parsing(char **commands, char **separators, int numCommands, int numSepa
 
 int ntl_execute(char **args) {
 
+    if(strcmp(args[0], "pin") == 0) return ntl_pin(args);
+
     char **commands = malloc(sizeof(char *) * (LIMIT + 1));
     char **separators = malloc(sizeof(char *) * (LIMIT + 1));
     int numCommands = 0;
@@ -552,6 +879,7 @@ int ntl_execute(char **args) {
         }
     }
     commands[numCommands] = NULL; // mark end of last command
+    separators[numSeparators] = NULL; // ntl_parsing looks one separator past the last one
 
     ntl_parsing(commands, separators, numCommands, numSeparators);
 